@@ -0,0 +1,84 @@
+--
+-- microbenchmark of the per-critical-section overhead.
+--
+-- it compares the following cases for sync.mutex and sync.cond;
+--
+--  ref lock/unlock: bench/lock_ref.c, that checks the instance with
+--                   luaL_checkudata (the metatable lookup in the registry).
+--  lock/unlock    : the lock/unlock methods, that check the instance against
+--                   the metatable cached in the upvalue.
+--  m:lock/m:unlock: same as above, plus the method lookup via __index.
+--  call           : the call method.
+--
+-- the first two cases call the functions through locals, so the difference
+-- between them is the cost of the dispatch only. build bench/lock_ref.so
+-- first (see bench/lock_ref.c), then run from the repository root;
+--
+--  $ lua ./bench/lock_bench.lua [iterations]
+--
+package.cpath = './bench/?.so;' .. package.cpath
+local mutex = require('sync.mutex')
+local cond = require('sync.cond')
+local ref = require('lock_ref')
+local N = tonumber(arg and arg[1]) or 1000000
+
+local function noop()
+end
+
+local function bench(name, fn)
+    -- warm up
+    fn(N / 10)
+    local t = os.clock()
+    fn(N)
+    t = os.clock() - t
+    print(('%-28s %8.3f sec %8.1f ns/op'):format(name, t, t / N * 1e9))
+end
+
+for _, v in ipairs({
+    {
+        new = mutex.new,
+        lock = ref.mutex_lock,
+        unlock = ref.mutex_unlock,
+    },
+    {
+        new = cond.new,
+        lock = ref.cond_lock,
+        unlock = ref.cond_unlock,
+    },
+}) do
+    local m = assert(v.new())
+    local tname = tostring(m):match('^[^:]+')
+
+    local lock, unlock = v.lock, v.unlock
+    bench(tname .. ' ref lock/unlock', function(n)
+        for _ = 1, n do
+            lock(m)
+            noop()
+            unlock(m)
+        end
+    end)
+
+    lock, unlock = m.lock, m.unlock
+    bench(tname .. ' lock/unlock', function(n)
+        for _ = 1, n do
+            lock(m)
+            noop()
+            unlock(m)
+        end
+    end)
+
+    bench(tname .. ' m:lock/m:unlock', function(n)
+        for _ = 1, n do
+            m:lock()
+            noop()
+            m:unlock()
+        end
+    end)
+
+    bench(tname .. ' call', function(n)
+        for _ = 1, n do
+            m:call(noop)
+        end
+    end)
+    m:destroy()
+end
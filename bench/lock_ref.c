@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  bench/lock_ref.c
+ *  lua-sync
+ *
+ *  reference lock/unlock for bench/lock_bench.lua. the functions are the same
+ *  as the lock/unlock methods of sync.mutex and sync.cond except that the
+ *  instance is checked with luaL_checkudata, that looks up the metatable in
+ *  the registry on every call. this module is not installed.
+ *
+ *  $ cc -O2 -fPIC -shared -I<lua incdir> -I<lauxhlib incdir> \
+ *       -o bench/lock_ref.so bench/lock_ref.c -lpthread
+ */
+
+// project
+#include "../src/sync.h"
+
+static sync_trace_t *TRACE = NULL;
+
+#define lockop_lua(L, t, tname)                                                \
+    do {                                                                       \
+        t *v = luaL_checkudata(L, 1, (tname));                                 \
+        if (v->locked == 0 &&                                                  \
+            sync_trace_lock(L, TRACE, (tname), v, v->mutex, &v->stat)) {       \
+            lua_pushboolean(L, 0);                                             \
+            lua_pushstring(L, strerror(errno));                                \
+            return 2;                                                          \
+        }                                                                      \
+        v->locked = 1;                                                         \
+        lua_pushboolean(L, 1);                                                 \
+        return 1;                                                              \
+    } while (0)
+
+#define unlockop_lua(L, t, tname)                                              \
+    do {                                                                       \
+        t *v = luaL_checkudata(L, 1, (tname));                                 \
+        if (v->locked == 1 &&                                                  \
+            sync_trace_unlock(L, TRACE, (tname), v, v->mutex, &v->stat)) {     \
+            lua_pushboolean(L, 0);                                             \
+            lua_pushstring(L, strerror(errno));                                \
+            return 2;                                                          \
+        }                                                                      \
+        v->locked = 0;                                                         \
+        lua_pushboolean(L, 1);                                                 \
+        return 1;                                                              \
+    } while (0)
+
+static int mutex_lock_lua(lua_State *L)
+{
+    lockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT);
+}
+
+static int mutex_unlock_lua(lua_State *L)
+{
+    unlockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT);
+}
+
+static int cond_lock_lua(lua_State *L)
+{
+    lockop_lua(L, sync_cond_t, SYNC_COND_MT);
+}
+
+static int cond_unlock_lua(lua_State *L)
+{
+    unlockop_lua(L, sync_cond_t, SYNC_COND_MT);
+}
+
+LUALIB_API int luaopen_lock_ref(lua_State *L)
+{
+    struct luaL_Reg funcs[] = {
+        {"mutex_lock",   mutex_lock_lua  },
+        {"mutex_unlock", mutex_unlock_lua},
+        {"cond_lock",    cond_lock_lua   },
+        {"cond_unlock",  cond_unlock_lua },
+        {NULL,           NULL            }
+    };
+    struct luaL_Reg *ptr = funcs;
+
+    lua_newtable(L);
+    while (ptr->name) {
+        lauxh_pushfn2tbl(L, ptr->name, ptr->func);
+        ptr++;
+    }
+    TRACE = sync_trace_open(L);
+    sync_pid_init();
+
+    return 1;
+}
@@ -0,0 +1,393 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  src/broadcast.c
+ *  lua-sync
+ *  Created by agent on 26/10/18.
+ *
+ */
+
+// project
+#include "sync.h"
+
+// system
+#include <limits.h>
+#include <signal.h>
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#define DEFAULT_NENTRY 64
+#define DEFAULT_SIZE   256
+
+#if defined(__linux__)
+
+static inline int futex_wait(uint32_t *addr, uint32_t val, uint64_t nsec)
+{
+    struct timespec ts = {
+        .tv_sec  = nsec / 1000000000ULL,
+        .tv_nsec = nsec % 1000000000ULL,
+    };
+
+    // the ring is shared between processes, so do not use FUTEX_PRIVATE_FLAG
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, val, nsec ? &ts : NULL, NULL,
+                0) == 0 ||
+        errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT) {
+        return 0;
+    }
+    return -1;
+}
+
+static inline void futex_wake(uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#else
+
+// fallback to polling
+static inline int futex_wait(uint32_t *addr, uint32_t val, uint64_t nsec)
+{
+    struct timespec ts = {
+        .tv_sec  = 0,
+        .tv_nsec = 1000000,
+    };
+
+    if (nsec && nsec < 1000000) {
+        ts.tv_nsec = nsec;
+    }
+    if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) {
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+static inline void futex_wake(uint32_t *addr)
+{
+    (void)addr;
+}
+
+#endif
+
+static int read_lua(lua_State *L)
+{
+    sync_broadcast_t *b      = sync_checkudata(L, SYNC_BROADCAST_MT);
+    lua_Number sec           = lauxh_optnumber(L, 2, -1);
+    sync_broadcast_ring_t *r = b->ring;
+    uint64_t deadline        = 0;
+
+    lauxh_argcheck(L, lua_isnoneornil(L, 2) || sec >= 0, 2,
+                   "sec must be greater or equal to 0");
+    if (!r) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EBADF));
+        return 2;
+    } else if (sec > 0) {
+        deadline = sync_clock() + (uint64_t)(sec * 1000000000.0);
+    }
+
+    while (1) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+        uint64_t now  = 0;
+        uint32_t val  = 0;
+
+        if (b->cursor < head) {
+            sync_broadcast_entry_t *e = NULL;
+            uint64_t seq              = 0;
+            uint32_t len              = 0;
+
+            // the writer has overwritten the entries that have not been read
+            if (head - b->cursor > r->nentry) {
+                uint64_t skipped = head - r->nentry - b->cursor;
+
+                b->cursor += skipped;
+                lua_pushnil(L);
+                lua_pushnil(L);
+                lua_pushboolean(L, 0);
+                lua_pushinteger(L, skipped);
+                return 4;
+            }
+
+            e   = sync_broadcast_entry(r, b->cursor);
+            seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            len = e->len;
+            if (seq == b->cursor + 1 && len <= r->size) {
+                lua_pushlstring(L, e->data, len);
+                // make sure that the entry was not overwritten while copying
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+                    b->cursor++;
+                    return 1;
+                }
+                lua_pop(L, 1);
+            }
+
+            // the writer is overwriting this entry, or it died while writing
+            // this entry. the entry is lost either way, so skip to the oldest
+            // entry that has not been overwritten, instead of waiting for it.
+            head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+            seq  = b->cursor + 1;
+            if (head + 1 > r->nentry && head + 1 - r->nentry > seq) {
+                seq = head + 1 - r->nentry;
+            }
+            lua_pushnil(L);
+            lua_pushnil(L);
+            lua_pushboolean(L, 0);
+            lua_pushinteger(L, seq - b->cursor);
+            b->cursor = seq;
+            return 4;
+        }
+
+        if (sec == 0 || (deadline && (now = sync_clock()) >= deadline)) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(ETIMEDOUT));
+            lua_pushboolean(L, 1);
+            return 3;
+        }
+
+        // the writer wakes up the readers only if the waiting flag is set.
+        // it clears the flag on every wake, so the flag set by a reader that
+        // died while waiting costs only one extra wake.
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+        val = __atomic_load_n(&r->futex, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == head &&
+            futex_wait(&r->futex, val, deadline ? deadline - now : 0)) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    }
+}
+
+static int seek_lua(lua_State *L)
+{
+    sync_broadcast_t *b = sync_checkudata(L, SYNC_BROADCAST_MT);
+    uint64_t head       = 0;
+
+    if (!b->ring) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EBADF));
+        return 2;
+    }
+
+    // skip the unread entries
+    head = __atomic_load_n(&b->ring->head, __ATOMIC_SEQ_CST);
+    lua_pushinteger(L, head > b->cursor ? head - b->cursor : 0);
+    b->cursor = head;
+
+    return 1;
+}
+
+static int claim_lua(lua_State *L)
+{
+    sync_broadcast_t *b      = sync_checkudata(L, SYNC_BROADCAST_MT);
+    sync_broadcast_ring_t *r = b->ring;
+    pid_t pid                = sync_getpid();
+    pid_t writer             = 0;
+
+    if (!r) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, strerror(EBADF));
+        return 2;
+    }
+
+    writer = __atomic_load_n(&r->writer, __ATOMIC_SEQ_CST);
+    while (writer != pid) {
+        // take over the ring if the writer has exited without releasing it
+        if (writer && (kill(writer, 0) == 0 || errno != ESRCH)) {
+            lua_pushboolean(L, 0);
+            lua_pushfstring(L, "the ring is claimed by another process: %d",
+                            (int)writer);
+            return 2;
+        } else if (__atomic_compare_exchange_n(&r->writer, &writer, pid, 0,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_SEQ_CST)) {
+            break;
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static inline void release_writer(sync_broadcast_ring_t *r)
+{
+    pid_t pid = sync_getpid();
+
+    __atomic_compare_exchange_n(&r->writer, &pid, 0, 0, __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+}
+
+static int publish_lua(lua_State *L)
+{
+    sync_broadcast_t *b       = sync_checkudata(L, SYNC_BROADCAST_MT);
+    size_t len                = 0;
+    const char *msg           = lauxh_checklstring(L, 2, &len);
+    sync_broadcast_ring_t *r  = b->ring;
+    sync_broadcast_entry_t *e = NULL;
+    uint64_t seq              = 0;
+    pid_t writer              = 0;
+
+    if (!r) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EBADF));
+        return 2;
+    } else if (len > r->size) {
+        char buf[16];
+
+        snprintf(buf, sizeof(buf), "%u", (unsigned int)r->size);
+        lauxh_argcheck(L, 0, 2, "msg must be less than or equal to %s bytes",
+                       buf);
+    }
+
+    // only the process that claimed the ring can publish to the ring
+    writer = __atomic_load_n(&r->writer, __ATOMIC_RELAXED);
+    if (writer != sync_getpid()) {
+        lua_pushnil(L);
+        if (writer) {
+            lua_pushfstring(L, "the ring is claimed by another process: %d",
+                            (int)writer);
+        } else {
+            lua_pushstring(L, "the ring is not claimed");
+        }
+        return 2;
+    }
+
+    seq = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    e   = sync_broadcast_entry(r, seq);
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->len = len;
+    memcpy(e->data, msg, len);
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, seq + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r->futex, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&r->futex);
+    }
+
+    lua_pushinteger(L, seq + 1);
+    return 1;
+}
+
+static int close_lua(lua_State *L)
+{
+    sync_broadcast_t *b = sync_checkudata(L, SYNC_BROADCAST_MT);
+
+    if (b->ring) {
+        release_writer(b->ring);
+        munmap((void *)b->ring, b->mapsize);
+        b->ring = NULL;
+    }
+
+    return 0;
+}
+
+static int tostring_lua(lua_State *L)
+{
+    lua_pushfstring(L, SYNC_BROADCAST_MT ": %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+static int gc_lua(lua_State *L)
+{
+    sync_broadcast_t *b = lua_touserdata(L, 1);
+
+    if (b->ring) {
+        release_writer(b->ring);
+        munmap((void *)b->ring, b->mapsize);
+    }
+
+    return 0;
+}
+
+static int new_lua(lua_State *L)
+{
+    uint32_t nentry          = lauxh_optuint32(L, 1, DEFAULT_NENTRY);
+    uint32_t size            = lauxh_optuint32(L, 2, DEFAULT_SIZE);
+    size_t limit             = 0;
+    size_t stride            = 0;
+    size_t mapsize           = 0;
+    sync_broadcast_t *b      = NULL;
+    sync_broadcast_ring_t *r = NULL;
+
+    lauxh_argcheck(L, nentry > 0, 1, "nentry must be greater than 0");
+    lauxh_argcheck(L, size > 0, 2, "size must be greater than 0");
+    // reject the arguments that overflow the size of the mapping
+    limit = SIZE_MAX - sizeof(sync_broadcast_ring_t);
+    lauxh_argcheck(L, size <= limit - sizeof(sync_broadcast_entry_t) - 7, 2,
+                   "size is too large");
+    // align the entries to 8 bytes boundary for the atomic operations
+    stride = (sizeof(sync_broadcast_entry_t) + size + 7) & ~(size_t)7;
+    lauxh_argcheck(L, nentry <= limit / stride, 1,
+                   "nentry * size is too large");
+    mapsize = sizeof(sync_broadcast_ring_t) + stride * nentry;
+
+    lua_settop(L, 0);
+    b = lua_newuserdata(L, sizeof(sync_broadcast_t));
+    b->cursor  = 0;
+    b->mapsize = mapsize;
+    b->ring    = NULL;
+    r = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED,
+             -1, 0);
+    if ((void *)r != MAP_FAILED) {
+        r->nentry = nentry;
+        r->size   = size;
+        r->stride = stride;
+        b->ring   = r;
+        lauxh_setmetatable(L, SYNC_BROADCAST_MT);
+        return 1;
+    }
+
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+
+    return 2;
+}
+
+LUALIB_API int luaopen_sync_broadcast(lua_State *L)
+{
+    struct luaL_Reg mmethods[] = {
+        {"__gc",       gc_lua      },
+        {"__tostring", tostring_lua},
+        {NULL,         NULL        }
+    };
+    struct luaL_Reg methods[] = {
+        {"claim",   claim_lua  },
+        {"close",   close_lua  },
+        {"publish", publish_lua},
+        {"read",    read_lua   },
+        {"seek",    seek_lua   },
+        {NULL,      NULL       }
+    };
+
+    sync_register(L, SYNC_BROADCAST_MT, mmethods, methods);
+    sync_pid_init();
+
+    // add new function
+    lua_newtable(L);
+    lauxh_pushfn2tbl(L, "new", new_lua);
+
+    return 1;
+}
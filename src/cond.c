@@ -31,13 +31,16 @@
 // system
 #include <math.h>
 
+static sync_trace_t *TRACE = NULL;
+
 static int timedwait_lua(lua_State *L)
 {
-    sync_cond_t *c          = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c          = sync_checkudata(L, SYNC_COND_MT);
     lua_Number sec          = lauxh_checknumber(L, 2);
     double isec             = 0.0;
     double fsec             = modf(sec, &isec);
     struct timespec abstime = {0};
+    int failed              = 0;
 
     lauxh_argcheck(L, sec >= 0, 2, "sec must be greater or equal to 0");
 
@@ -55,7 +58,11 @@ static int timedwait_lua(lua_State *L)
         abstime.tv_sec += isec;
     }
 
-    if (sync_cond_timedwait(c->cond, c->mutex, &abstime)) {
+    sync_trace_released(c->mutex, &c->stat);
+    failed = sync_cond_timedwait(c->cond, c->mutex, &abstime);
+    // the mutex is reacquired even if it timed out
+    sync_trace_reacquired(c->mutex, &c->stat);
+    if (failed) {
         lua_pushboolean(L, 0);
         lua_pushstring(L, strerror(errno));
         lua_pushboolean(L, errno == ETIMEDOUT);
@@ -69,9 +76,13 @@ static int timedwait_lua(lua_State *L)
 
 static int wait_lua(lua_State *L)
 {
-    sync_cond_t *c = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c = sync_checkudata(L, SYNC_COND_MT);
+    int failed     = 0;
 
-    if (sync_cond_wait(c->cond, c->mutex)) {
+    sync_trace_released(c->mutex, &c->stat);
+    failed = sync_cond_wait(c->cond, c->mutex);
+    sync_trace_reacquired(c->mutex, &c->stat);
+    if (failed) {
         lua_pushboolean(L, 0);
         lua_pushstring(L, strerror(errno));
         return 2;
@@ -84,7 +95,7 @@ static int wait_lua(lua_State *L)
 
 static int broadcast_lua(lua_State *L)
 {
-    sync_cond_t *c = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c = sync_checkudata(L, SYNC_COND_MT);
 
     if (sync_cond_broadcast(c->cond)) {
         lua_pushboolean(L, 0);
@@ -99,7 +110,7 @@ static int broadcast_lua(lua_State *L)
 
 static int signal_lua(lua_State *L)
 {
-    sync_cond_t *c = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c = sync_checkudata(L, SYNC_COND_MT);
 
     if (sync_cond_signal(c->cond)) {
         lua_pushboolean(L, 0);
@@ -112,20 +123,28 @@ static int signal_lua(lua_State *L)
     return 1;
 }
 
+static int call_lua(lua_State *L)
+{
+    sync_callop_lua(L, sync_cond_t, SYNC_COND_MT, TRACE);
+}
+
 static int unlock_lua(lua_State *L)
 {
-    sync_unlockop_lua(L, sync_cond_t, SYNC_COND_MT, sync_mutex_unlock);
+    sync_unlockop_lua(L, sync_cond_t, SYNC_COND_MT, TRACE);
 }
 
 static int trylock_lua(lua_State *L)
 {
-    sync_cond_t *c = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c = sync_checkudata(L, SYNC_COND_MT);
 
-    if (c->locked == 0 && sync_mutex_trylock(c->mutex)) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, strerror(errno));
-        lua_pushboolean(L, errno == EBUSY);
-        return 3;
+    if (c->locked == 0) {
+        if (sync_mutex_trylock(c->mutex)) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, strerror(errno));
+            lua_pushboolean(L, errno == EBUSY);
+            return 3;
+        }
+        sync_trace_acquired(TRACE, c->mutex, &c->stat);
     }
 
     c->locked = 1;
@@ -136,12 +155,12 @@ static int trylock_lua(lua_State *L)
 
 static int lock_lua(lua_State *L)
 {
-    sync_lockop_lua(L, sync_cond_t, SYNC_COND_MT, sync_mutex_lock);
+    sync_lockop_lua(L, sync_cond_t, SYNC_COND_MT, TRACE);
 }
 
 static int destroy_lua(lua_State *L)
 {
-    sync_cond_t *c = luaL_checkudata(L, 1, SYNC_COND_MT);
+    sync_cond_t *c = sync_checkudata(L, SYNC_COND_MT);
 
     if (c->cond) {
         if (sync_cond_destroy(c->cond)) {
@@ -199,6 +218,11 @@ static int new_lua(lua_State *L)
     sync_cond_t *c = lua_newuserdata(L, sizeof(sync_cond_t));
 
     c->locked = 0;
+    c->stat   = (sync_trace_stat_t){0};
+    // pick up the trace ring if sync.trace was loaded after this module
+    if (!TRACE) {
+        TRACE = sync_trace_open(L);
+    }
     if ((c->mutex = sync_mutex_alloc())) {
         if ((c->cond = sync_cond_alloc())) {
             lauxh_setmetatable(L, SYNC_COND_MT);
@@ -221,6 +245,7 @@ LUALIB_API int luaopen_sync_cond(lua_State *L)
         {NULL,         NULL        }
     };
     struct luaL_Reg methods[] = {
+        {"call",      call_lua     },
         {"destroy",   destroy_lua  },
         {"lock",      lock_lua     },
         {"trylock",   trylock_lua  },
@@ -233,6 +258,8 @@ LUALIB_API int luaopen_sync_cond(lua_State *L)
     };
 
     sync_register(L, SYNC_COND_MT, mmethods, methods);
+    TRACE = sync_trace_open(L);
+    sync_pid_init();
 
     // add new function
     lua_newtable(L);
@@ -28,20 +28,30 @@
 // project
 #include "sync.h"
 
+static sync_trace_t *TRACE = NULL;
+
+static int call_lua(lua_State *L)
+{
+    sync_callop_lua(L, sync_mutex_t, SYNC_MUTEX_MT, TRACE);
+}
+
 static int unlock_lua(lua_State *L)
 {
-    sync_unlockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT, sync_mutex_unlock);
+    sync_unlockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT, TRACE);
 }
 
 static int trylock_lua(lua_State *L)
 {
-    sync_mutex_t *m = luaL_checkudata(L, 1, SYNC_MUTEX_MT);
+    sync_mutex_t *m = sync_checkudata(L, SYNC_MUTEX_MT);
 
-    if (m->locked == 0 && sync_mutex_trylock(m->mutex)) {
-        lua_pushboolean(L, 0);
-        lua_pushstring(L, strerror(errno));
-        lua_pushboolean(L, errno == EBUSY);
-        return 3;
+    if (m->locked == 0) {
+        if (sync_mutex_trylock(m->mutex)) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, strerror(errno));
+            lua_pushboolean(L, errno == EBUSY);
+            return 3;
+        }
+        sync_trace_acquired(TRACE, m->mutex, &m->stat);
     }
 
     m->locked = 1;
@@ -52,12 +62,12 @@ static int trylock_lua(lua_State *L)
 
 static int lock_lua(lua_State *L)
 {
-    sync_lockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT, sync_mutex_lock);
+    sync_lockop_lua(L, sync_mutex_t, SYNC_MUTEX_MT, TRACE);
 }
 
 static int destroy_lua(lua_State *L)
 {
-    sync_mutex_t *m = luaL_checkudata(L, 1, SYNC_MUTEX_MT);
+    sync_mutex_t *m = sync_checkudata(L, SYNC_MUTEX_MT);
 
     if (m->mutex) {
         if (m->locked) {
@@ -103,6 +113,11 @@ static int new_lua(lua_State *L)
     sync_mutex_t *m = lua_newuserdata(L, sizeof(sync_mutex_t));
 
     m->locked = 0;
+    m->stat   = (sync_trace_stat_t){0};
+    // pick up the trace ring if sync.trace was loaded after this module
+    if (!TRACE) {
+        TRACE = sync_trace_open(L);
+    }
     if ((m->mutex = sync_mutex_alloc())) {
         lauxh_setmetatable(L, SYNC_MUTEX_MT);
         return 1;
@@ -122,6 +137,7 @@ LUALIB_API int luaopen_sync_mutex(lua_State *L)
         {NULL,         NULL        }
     };
     struct luaL_Reg methods[] = {
+        {"call",    call_lua   },
         {"destroy", destroy_lua},
         {"lock",    lock_lua   },
         {"trylock", trylock_lua},
@@ -130,6 +146,8 @@ LUALIB_API int luaopen_sync_mutex(lua_State *L)
     };
 
     sync_register(L, SYNC_MUTEX_MT, mmethods, methods);
+    TRACE = sync_trace_open(L);
+    sync_pid_init();
 
     // add new function
     lua_newtable(L);
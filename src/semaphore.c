@@ -34,7 +34,7 @@
 
 static int trywait_lua(lua_State *L)
 {
-    sync_sem_t *s = luaL_checkudata(L, 1, SYNC_SEMAPHORE_MT);
+    sync_sem_t *s = sync_checkudata(L, SYNC_SEMAPHORE_MT);
 
     if (sem_trywait(s->sem) == 0) {
         lua_pushboolean(L, 1);
@@ -50,7 +50,7 @@ static int trywait_lua(lua_State *L)
 
 static int wait_lua(lua_State *L)
 {
-    sync_sem_t *s = luaL_checkudata(L, 1, SYNC_SEMAPHORE_MT);
+    sync_sem_t *s = sync_checkudata(L, SYNC_SEMAPHORE_MT);
 
     if (sem_wait(s->sem) == 0) {
         lua_pushboolean(L, 1);
@@ -65,7 +65,7 @@ static int wait_lua(lua_State *L)
 
 static int post_lua(lua_State *L)
 {
-    sync_sem_t *s = luaL_checkudata(L, 1, SYNC_SEMAPHORE_MT);
+    sync_sem_t *s = sync_checkudata(L, SYNC_SEMAPHORE_MT);
 
     if (sem_post(s->sem) == 0) {
         lua_pushboolean(L, 1);
@@ -80,7 +80,7 @@ static int post_lua(lua_State *L)
 
 static int close_lua(lua_State *L)
 {
-    sync_sem_t *s = luaL_checkudata(L, 1, SYNC_SEMAPHORE_MT);
+    sync_sem_t *s = sync_checkudata(L, SYNC_SEMAPHORE_MT);
 
     if (s->sem) {
         sync_sem_free(s->sem);
@@ -28,13 +28,21 @@
 #ifndef lua_sync_h
 #define lua_sync_h
 
+// for dladdr
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
 // depend
 #include "lauxhlib.h"
 
 // system
+#include <dlfcn.h>
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -43,15 +51,26 @@
 #include <unistd.h>
 
 // helper macros
+static inline void sync_pushmethod(lua_State *L, int mt, const char *name,
+                                   lua_CFunction fn)
+{
+    // keep the metatable in the upvalue for sync_checkudata
+    lua_pushstring(L, name);
+    lua_pushvalue(L, mt);
+    lua_pushcclosure(L, fn, 1);
+    lua_rawset(L, -3);
+}
+
 static inline void sync_register(lua_State *L, const char *tname,
                                  struct luaL_Reg *mmethods,
                                  struct luaL_Reg *methods)
 {
     if (luaL_newmetatable(L, tname)) {
+        int mt               = lua_gettop(L);
         struct luaL_Reg *ptr = mmethods;
 
         while (ptr->name) {
-            lauxh_pushfn2tbl(L, ptr->name, ptr->func);
+            sync_pushmethod(L, mt, ptr->name, ptr->func);
             ptr++;
         }
 
@@ -59,7 +78,7 @@ static inline void sync_register(lua_State *L, const char *tname,
         lua_newtable(L);
         ptr = methods;
         while (ptr->name) {
-            lauxh_pushfn2tbl(L, ptr->name, ptr->func);
+            sync_pushmethod(L, mt, ptr->name, ptr->func);
             ptr++;
         }
         lua_rawset(L, -3);
@@ -67,6 +86,65 @@ static inline void sync_register(lua_State *L, const char *tname,
     lua_pop(L, 1);
 }
 
+// fast path of luaL_checkudata(L, 1, tname) for the methods registered by
+// sync_register. it compares the metatable of the first argument with the
+// upvalue instead of looking up the registry.
+static inline void *sync_checkudata(lua_State *L, const char *tname)
+{
+    void *v = lua_touserdata(L, 1);
+
+    if (v && lua_getmetatable(L, 1)) {
+        int eq = lua_rawequal(L, -1, lua_upvalueindex(1));
+
+        lua_pop(L, 1);
+        if (eq) {
+            return v;
+        }
+    }
+    // raise the type error
+    return luaL_checkudata(L, 1, tname);
+}
+
+// monotonic clock in nanoseconds
+static inline uint64_t sync_clock(void)
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// process-local cache of getpid(), since glibc does not cache it
+static inline pid_t *sync_pidref(void)
+{
+    static pid_t pid = 0;
+    return &pid;
+}
+
+static inline pid_t sync_getpid(void)
+{
+    return *sync_pidref();
+}
+
+static inline void sync_pid_atfork_child(void)
+{
+    *sync_pidref() = getpid();
+}
+
+static inline void sync_pid_init(void)
+{
+    if (!*sync_pidref()) {
+        Dl_info info;
+
+        *sync_pidref() = getpid();
+        // the atfork handler must outlive lua_close, so pin this module
+        if (dladdr((void *)sync_pid_atfork_child, &info) && info.dli_fname) {
+            dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+        }
+        pthread_atfork(NULL, NULL, sync_pid_atfork_child);
+    }
+}
+
 // semaphore
 #define SYNC_SEMAPHORE_MT "sync.semaphore"
 
@@ -109,9 +187,9 @@ LUALIB_API int luaopen_sync_semaphore(lua_State *L);
 #define sync_shmfree(t, v) munmap((void *)(v), sizeof(t))
 
 // helper macros for pthread operations
-#define sync_pthread_alloc(t)                                                  \
+#define sync_pthread_alloc(t, st)                                              \
     ({                                                                         \
-        pthread_##t##_t *v = sync_shmalloc(pthread_##t##_t);                   \
+        pthread_##t##_t *v = (pthread_##t##_t *)sync_shmalloc(st);             \
         if ((void *)v != MAP_FAILED) {                                         \
             pthread_##t##attr_t a;                                             \
             int rc = pthread_##t##attr_init(&a);                               \
@@ -119,7 +197,7 @@ LUALIB_API int luaopen_sync_semaphore(lua_State *L);
                 (rc = pthread_##t##attr_setpshared(&a,                         \
                                                    PTHREAD_PROCESS_SHARED)) || \
                 (rc = pthread_##t##_init(v, &a))) {                            \
-                sync_shmfree(pthread_##t##_t, v);                              \
+                sync_shmfree(st, v);                                           \
                 v     = NULL;                                                  \
                 errno = rc;                                                    \
             }                                                                  \
@@ -138,10 +216,265 @@ LUALIB_API int luaopen_sync_semaphore(lua_State *L);
         rc;                                                                    \
     })
 
-#define sync_lockop_lua(L, t, tname, lockfn)                                   \
+// process-shared mutex with the pid of the lock holder
+typedef struct {
+    pthread_mutex_t mutex;
+    // set only while tracing is enabled, 0 if unknown
+    pid_t owner;
+} sync_shmutex_t;
+
+#define sync_mutex_owner(m) (&((sync_shmutex_t *)(m))->owner)
+
+// slow-lock trace ring
+#define SYNC_TRACE_KEY     "sync.trace"
+#define SYNC_TRACE_NRECORD 256
+#define SYNC_TRACE_NAMELEN 16
+#define SYNC_TRACE_SRCLEN  60
+// upper bound of the threshold in seconds
+#define SYNC_TRACE_MAXSEC  86400
+
+#define SYNC_TRACE_WRITING UINT64_MAX
+
+enum {
+    SYNC_TRACE_LOCK = 1,
+    SYNC_TRACE_UNLOCK,
+    SYNC_TRACE_STALL,
+};
+
+typedef struct {
+    // SYNC_TRACE_WRITING while the record is being written, otherwise the
+    // record number + 1
+    uint64_t seq;
+    // monotonic clock in nanoseconds
+    uint64_t time;
+    uint64_t wait;
+    uint64_t hold;
+    uintptr_t addr;
+    pid_t pid;
+    pid_t holder;
+    int op;
+    int line;
+    char name[SYNC_TRACE_NAMELEN];
+    char source[SYNC_TRACE_SRCLEN];
+} sync_trace_record_t;
+
+typedef struct {
+    // threshold in nanoseconds, 0 means disabled
+    uint64_t threshold;
+    uint64_t head;
+    sync_trace_record_t records[SYNC_TRACE_NRECORD];
+} sync_trace_t;
+
+typedef struct {
+    uint64_t acquired;
+    uint64_t wait;
+} sync_trace_stat_t;
+
+static inline uint64_t sync_trace_threshold(sync_trace_t *trace)
+{
+    if (trace) {
+        return __atomic_load_n(&trace->threshold, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static inline void sync_trace_record(lua_State *L, sync_trace_t *trace, int op,
+                                     const char *tname, void *addr,
+                                     pid_t holder, uint64_t time,
+                                     uint64_t wait, uint64_t hold)
+{
+    uint64_t seq           = 0;
+    uint64_t prev          = 0;
+    sync_trace_record_t *r = NULL;
+    lua_Debug ar;
+
+    seq  = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    r    = &trace->records[seq % SYNC_TRACE_NRECORD];
+    prev = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+    // drop the record if another writer is writing to the slot or has
+    // already written a newer record to it
+    if (prev > seq ||
+        !__atomic_compare_exchange_n(&r->seq, &prev, SYNC_TRACE_WRITING, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->time   = time;
+    r->wait   = wait;
+    r->hold   = hold;
+    r->addr   = (uintptr_t)addr;
+    r->pid    = sync_getpid();
+    r->holder = holder;
+    r->op     = op;
+    r->line   = -1;
+    snprintf(r->name, SYNC_TRACE_NAMELEN, "%s", tname);
+    snprintf(r->source, SYNC_TRACE_SRCLEN, "?");
+    // level 1 is the lua function that called the lock method
+    if (lua_getstack(L, 1, &ar) && lua_getinfo(L, "Sl", &ar)) {
+        snprintf(r->source, SYNC_TRACE_SRCLEN, "%s", ar.short_src);
+        r->line = ar.currentline;
+    }
+
+    __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline sync_trace_t *sync_trace_open(lua_State *L)
+{
+    sync_trace_t *trace = NULL;
+
+    // the trace ring is published to the registry when sync.trace is loaded
+    lua_getfield(L, LUA_REGISTRYINDEX, SYNC_TRACE_KEY);
+    trace = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return trace;
+}
+
+static inline void sync_trace_acquired(sync_trace_t *trace,
+                                       pthread_mutex_t *mutex,
+                                       sync_trace_stat_t *stat)
+{
+    stat->wait     = 0;
+    stat->acquired = 0;
+    if (sync_trace_threshold(trace)) {
+        __atomic_store_n(sync_mutex_owner(mutex), sync_getpid(),
+                         __ATOMIC_RELAXED);
+        stat->acquired = sync_clock();
+    }
+}
+
+static inline void sync_trace_released(pthread_mutex_t *mutex,
+                                       sync_trace_stat_t *stat)
+{
+    // clear the owner before releasing the mutex
+    if (stat->acquired) {
+        __atomic_store_n(sync_mutex_owner(mutex), 0, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void sync_trace_reacquired(pthread_mutex_t *mutex,
+                                         sync_trace_stat_t *stat)
+{
+    // the mutex was released while waiting for the cond
+    if (stat->acquired) {
+        __atomic_store_n(sync_mutex_owner(mutex), sync_getpid(),
+                         __ATOMIC_RELAXED);
+        stat->acquired = sync_clock();
+    }
+}
+
+static inline int sync_trace_lock(lua_State *L, sync_trace_t *trace,
+                                  const char *tname, void *addr,
+                                  pthread_mutex_t *mutex,
+                                  sync_trace_stat_t *stat)
+{
+    uint64_t threshold = sync_trace_threshold(trace);
+    uint64_t t         = 0;
+    pid_t holder       = 0;
+
+    stat->acquired = 0;
+    stat->wait     = 0;
+    if (!threshold) {
+        return sync_pthread_op(pthread_mutex_lock, mutex);
+    }
+
+    // no need to measure the wait time if it can be locked immediately
+    if (sync_pthread_op(pthread_mutex_trylock, mutex) == 0) {
+        __atomic_store_n(sync_mutex_owner(mutex), sync_getpid(),
+                         __ATOMIC_RELAXED);
+        stat->acquired = sync_clock();
+        return 0;
+    } else if (errno != EBUSY) {
+        return -1;
+    }
+
+    holder = __atomic_load_n(sync_mutex_owner(mutex), __ATOMIC_RELAXED);
+    t      = sync_clock();
+#if defined(_POSIX_TIMEOUTS) && _POSIX_TIMEOUTS > 0
+    {
+        struct timespec abstime = {0};
+
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += threshold / 1000000000ULL;
+        abstime.tv_nsec += threshold % 1000000000ULL;
+        if (abstime.tv_nsec >= 1000000000L) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000L;
+        }
+        if (sync_pthread_op(pthread_mutex_timedlock, mutex, &abstime)) {
+            uint64_t now = 0;
+
+            if (errno != ETIMEDOUT) {
+                return -1;
+            }
+            // record the stall before waiting for the holder indefinitely
+            now    = sync_clock();
+            holder = __atomic_load_n(sync_mutex_owner(mutex),
+                                     __ATOMIC_RELAXED);
+            sync_trace_record(L, trace, SYNC_TRACE_STALL, tname, addr, holder,
+                              now, now - t, 0);
+            if (sync_pthread_op(pthread_mutex_lock, mutex)) {
+                return -1;
+            }
+        }
+    }
+#else
+    if (sync_pthread_op(pthread_mutex_lock, mutex)) {
+        return -1;
+    }
+#endif
+    __atomic_store_n(sync_mutex_owner(mutex), sync_getpid(), __ATOMIC_RELAXED);
+    stat->acquired = sync_clock();
+    stat->wait     = stat->acquired - t;
+    if (stat->wait >= threshold) {
+        sync_trace_record(L, trace, SYNC_TRACE_LOCK, tname, addr, holder,
+                          stat->acquired, stat->wait, 0);
+    }
+
+    return 0;
+}
+
+static inline int sync_trace_unlock(lua_State *L, sync_trace_t *trace,
+                                    const char *tname, void *addr,
+                                    pthread_mutex_t *mutex,
+                                    sync_trace_stat_t *stat)
+{
+    uint64_t now  = 0;
+    uint64_t hold = 0;
+
+    if (stat->acquired) {
+        now  = sync_clock();
+        hold = now - stat->acquired;
+    }
+    sync_trace_released(mutex, stat);
+    if (sync_pthread_op(pthread_mutex_unlock, mutex)) {
+        if (stat->acquired) {
+            __atomic_store_n(sync_mutex_owner(mutex), sync_getpid(),
+                             __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    stat->acquired = 0;
+
+    if (hold) {
+        uint64_t threshold = sync_trace_threshold(trace);
+        if (threshold && hold >= threshold) {
+            sync_trace_record(L, trace, SYNC_TRACE_UNLOCK, tname, addr,
+                              sync_getpid(), now, stat->wait, hold);
+        }
+    }
+
+    return 0;
+}
+
+LUALIB_API int luaopen_sync_trace(lua_State *L);
+
+#define sync_lockop_lua(L, t, tname, trace)                                    \
     do {                                                                       \
-        t *v = luaL_checkudata(L, 1, (tname));                                 \
-        if (v->locked == 0 && lockfn(v->mutex)) {                              \
+        t *v = sync_checkudata(L, (tname));                                    \
+        if (v->locked == 0 &&                                                  \
+            sync_trace_lock(L, (trace), (tname), v, v->mutex, &v->stat)) {     \
             lua_pushboolean(L, 0);                                             \
             lua_pushstring(L, strerror(errno));                                \
             return 2;                                                          \
@@ -151,10 +484,11 @@ LUALIB_API int luaopen_sync_semaphore(lua_State *L);
         return 1;                                                              \
     } while (0)
 
-#define sync_unlockop_lua(L, t, tname, unlockfn)                               \
+#define sync_unlockop_lua(L, t, tname, trace)                                  \
     do {                                                                       \
-        t *v = luaL_checkudata(L, 1, (tname));                                 \
-        if (v->locked == 1 && unlockfn(v->mutex)) {                            \
+        t *v = sync_checkudata(L, (tname));                                    \
+        if (v->locked == 1 &&                                                  \
+            sync_trace_unlock(L, (trace), (tname), v, v->mutex, &v->stat)) {   \
             lua_pushboolean(L, 0);                                             \
             lua_pushstring(L, strerror(errno));                                \
             return 2;                                                          \
@@ -164,15 +498,52 @@ LUALIB_API int luaopen_sync_semaphore(lua_State *L);
         return 1;                                                              \
     } while (0)
 
+// lock, call the function at index 2 with the rest arguments and unlock.
+// the lock is always released even if the function raises an error.
+// NOTE: the function cannot yield since it is called by lua_pcall.
+#define sync_callop_lua(L, t, tname, trace)                                    \
+    do {                                                                       \
+        t *v      = sync_checkudata(L, (tname));                               \
+        int owner = !v->locked;                                                \
+        int rc    = 0;                                                         \
+        luaL_checktype(L, 2, LUA_TFUNCTION);                                   \
+        if (owner) {                                                           \
+            if (sync_trace_lock(L, (trace), (tname), v, v->mutex, &v->stat)) { \
+                return luaL_error(L, "failed to lock: %s", strerror(errno));   \
+            }                                                                  \
+            v->locked = 1;                                                     \
+        }                                                                      \
+        rc = lua_pcall(L, lua_gettop(L) - 2, LUA_MULTRET, 0);                  \
+        /* the function may have released the lock by itself */               \
+        if (owner && v->locked) {                                              \
+            if (sync_trace_unlock(L, (trace), (tname), v, v->mutex,            \
+                                  &v->stat)) {                                 \
+                /* keep the locked flag to release it by destroy or GC */     \
+                const char *errstr = strerror(errno);                          \
+                if (rc && lua_type(L, -1) == LUA_TSTRING) {                    \
+                    return luaL_error(L, "failed to unlock: %s (%s)", errstr,  \
+                                      lua_tostring(L, -1));                    \
+                }                                                              \
+                return luaL_error(L, "failed to unlock: %s", errstr);          \
+            }                                                                  \
+            v->locked = 0;                                                     \
+        }                                                                      \
+        if (rc) {                                                              \
+            return lua_error(L);                                               \
+        }                                                                      \
+        return lua_gettop(L) - 1;                                              \
+    } while (0)
+
 #define SYNC_MUTEX_MT "sync.mutex"
 
 typedef struct {
     int locked;
     pthread_mutex_t *mutex;
+    sync_trace_stat_t stat;
 } sync_mutex_t;
 
-#define sync_mutex_alloc()    sync_pthread_alloc(mutex)
-#define sync_mutex_free(m)    sync_shmfree(pthread_mutex_t, m)
+#define sync_mutex_alloc()    sync_pthread_alloc(mutex, sync_shmutex_t)
+#define sync_mutex_free(m)    sync_shmfree(sync_shmutex_t, m)
 #define sync_mutex_lock(m)    sync_pthread_op(pthread_mutex_lock, m)
 #define sync_mutex_trylock(m) sync_pthread_op(pthread_mutex_trylock, m)
 #define sync_mutex_unlock(m)  sync_pthread_op(pthread_mutex_unlock, m)
@@ -187,9 +558,10 @@ typedef struct {
     int ref;
     pthread_cond_t *cond;
     pthread_mutex_t *mutex;
+    sync_trace_stat_t stat;
 } sync_cond_t;
 
-#define sync_cond_alloc()      sync_pthread_alloc(cond)
+#define sync_cond_alloc()      sync_pthread_alloc(cond, pthread_cond_t)
 #define sync_cond_free(c)      sync_shmfree(pthread_cond_t, c)
 #define sync_cond_signal(c)    sync_pthread_op(pthread_cond_signal, c)
 #define sync_cond_broadcast(c) sync_pthread_op(pthread_cond_broadcast, c)
@@ -200,4 +572,42 @@ typedef struct {
 
 LUALIB_API int luaopen_sync_cond(lua_State *L);
 
+// single-writer, multi-reader broadcast ring
+#define SYNC_BROADCAST_MT "sync.broadcast"
+
+typedef struct {
+    // 0 while the entry is being written, otherwise the sequence + 1
+    uint64_t seq;
+    uint32_t len;
+    char data[];
+} sync_broadcast_entry_t;
+
+typedef struct {
+    // number of published entries
+    uint64_t head;
+    // incremented to wake up the waiting readers
+    uint32_t futex;
+    // set by the readers before waiting, cleared by the writer on every wake
+    uint32_t waiting;
+    // pid of the process that claimed the ring, 0 if not claimed
+    pid_t writer;
+    uint32_t nentry;
+    uint32_t size;
+    size_t stride;
+    char entries[];
+} sync_broadcast_ring_t;
+
+typedef struct {
+    // sequence of the next entry to read in this process
+    uint64_t cursor;
+    size_t mapsize;
+    sync_broadcast_ring_t *ring;
+} sync_broadcast_t;
+
+#define sync_broadcast_entry(r, seq)                                           \
+    ((sync_broadcast_entry_t *)((r)->entries +                                 \
+                                ((seq) % (r)->nentry) * (r)->stride))
+
+LUALIB_API int luaopen_sync_broadcast(lua_State *L);
+
 #endif
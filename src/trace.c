@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2018 Masatoshi Fukunaga
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to
+ *  deal in the Software without restriction, including without limitation the
+ *  rights to use, copy, modify, merge, publish, distribute, sublicense,
+ *  and/or sell copies of the Software, and to permit persons to whom the
+ *  Software is furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in
+ *  all copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ *  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ *  DEALINGS IN THE SOFTWARE.
+ *
+ *  src/trace.c
+ *  lua-sync
+ *  Created by agent on 26/10/18.
+ *
+ */
+
+// project
+#include "sync.h"
+
+// process-wide trace ring shared with the forked processes
+static sync_trace_t *TRACE = NULL;
+
+static int dump_lua(lua_State *L)
+{
+    uint64_t head = __atomic_load_n(&TRACE->head, __ATOMIC_ACQUIRE);
+    uint64_t seq  = head > SYNC_TRACE_NRECORD ? head - SYNC_TRACE_NRECORD : 0;
+    int idx       = 0;
+
+    lua_settop(L, 0);
+    lua_newtable(L);
+    for (; seq < head; seq++) {
+        sync_trace_record_t *r = &TRACE->records[seq % SYNC_TRACE_NRECORD];
+        sync_trace_record_t rec;
+
+        // skip the record that is being written or already overwritten
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq + 1) {
+            continue;
+        }
+        memcpy(&rec, r, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq + 1) {
+            continue;
+        }
+        rec.name[SYNC_TRACE_NAMELEN - 1]  = 0;
+        rec.source[SYNC_TRACE_SRCLEN - 1] = 0;
+
+        lua_createtable(L, 0, 9);
+        switch (rec.op) {
+        case SYNC_TRACE_LOCK:
+            lua_pushliteral(L, "lock");
+            break;
+        case SYNC_TRACE_STALL:
+            lua_pushliteral(L, "stall");
+            break;
+        default:
+            lua_pushliteral(L, "unlock");
+        }
+        lua_setfield(L, -2, "op");
+        lua_pushnumber(L, (lua_Number)rec.time / 1000000000.0);
+        lua_setfield(L, -2, "time");
+        lua_pushinteger(L, rec.pid);
+        lua_setfield(L, -2, "pid");
+        lua_pushinteger(L, rec.holder);
+        lua_setfield(L, -2, "holder");
+        lua_pushfstring(L, "%s: %p", rec.name, (void *)rec.addr);
+        lua_setfield(L, -2, "object");
+        lua_pushnumber(L, (lua_Number)rec.wait / 1000000000.0);
+        lua_setfield(L, -2, "wait");
+        lua_pushnumber(L, (lua_Number)rec.hold / 1000000000.0);
+        lua_setfield(L, -2, "hold");
+        lua_pushstring(L, rec.source);
+        lua_setfield(L, -2, "source");
+        lua_pushinteger(L, rec.line);
+        lua_setfield(L, -2, "line");
+        lua_rawseti(L, -2, ++idx);
+    }
+
+    return 1;
+}
+
+static int disable_lua(lua_State *L)
+{
+    (void)L;
+    __atomic_store_n(&TRACE->threshold, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int enable_lua(lua_State *L)
+{
+    lua_Number sec     = lauxh_checknumber(L, 1);
+    uint64_t threshold = 0;
+
+    lauxh_argcheck(L, sec > 0, 1, "sec must be greater than 0");
+    lauxh_argcheck(L, sec <= SYNC_TRACE_MAXSEC, 1,
+                   "sec must be less than or equal to %d", SYNC_TRACE_MAXSEC);
+    threshold = (uint64_t)(sec * 1000000000.0);
+    // 0 means disabled
+    if (!threshold) {
+        threshold = 1;
+    }
+    __atomic_store_n(&TRACE->threshold, threshold, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+LUALIB_API int luaopen_sync_trace(lua_State *L)
+{
+    if (!TRACE) {
+        sync_trace_t *trace = sync_shmalloc(sync_trace_t);
+
+        if ((void *)trace == MAP_FAILED) {
+            return luaL_error(L, "failed to allocate the trace ring: %s",
+                              strerror(errno));
+        }
+        TRACE = trace;
+    }
+    sync_pid_init();
+    lua_pushlightuserdata(L, TRACE);
+    lua_setfield(L, LUA_REGISTRYINDEX, SYNC_TRACE_KEY);
+
+    lua_newtable(L);
+    lauxh_pushfn2tbl(L, "enable", enable_lua);
+    lauxh_pushfn2tbl(L, "disable", disable_lua);
+    lauxh_pushfn2tbl(L, "dump", dump_lua);
+
+    return 1;
+}
@@ -0,0 +1,199 @@
+require('luacov')
+local testcase = require('testcase')
+local fork = require('testcase.fork')
+local sleep = require('testcase.timer').sleep
+local assert = require('assert')
+local broadcast = require('sync.broadcast')
+
+function testcase.new_returns_object()
+    local b = broadcast.new()
+    assert.not_nil(b)
+    assert.match(tostring(b), '^sync%.broadcast: 0x', false)
+    b:close()
+end
+
+function testcase.new_throws_error_on_invalid_argument()
+    local err = assert.throws(broadcast.new, 0)
+    assert.match(err, 'nentry must be greater than 0', true)
+    err = assert.throws(broadcast.new, 1, 0)
+    assert.match(err, 'size must be greater than 0', true)
+    err = assert.throws(broadcast.new, 0xffffffff, 0xffffffff)
+    assert.match(err, 'nentry * size is too large', true)
+end
+
+function testcase.publish_and_read()
+    local b = broadcast.new(4, 8)
+    assert.is_true(b:claim())
+    assert.equal(b:publish('foo'), 1)
+    assert.equal(b:publish(''), 2)
+    assert.equal(b:read(), 'foo')
+    assert.equal(b:read(), '')
+    b:close()
+end
+
+function testcase.publish_throws_error_on_too_large_message()
+    local b = broadcast.new(4, 8)
+    local err = assert.throws(b.publish, b, '123456789')
+    assert.match(err, 'msg must be less than or equal to 8 bytes', true)
+    b:close()
+end
+
+function testcase.publish_fails_if_not_claimed()
+    local b = broadcast.new()
+    local seq, err = b:publish('foo')
+    assert.is_nil(seq)
+    assert.match(err, 'the ring is not claimed', true)
+    b:close()
+end
+
+function testcase.claim_fails_in_another_process()
+    local b = broadcast.new()
+    assert.is_true(b:claim())
+    -- claiming twice is allowed
+    assert.is_true(b:claim())
+    assert.equal(b:publish('foo'), 1)
+    local p = assert(fork())
+    if p:is_child() then
+        local ok, err = b:claim()
+        assert.is_false(ok)
+        assert.match(err, 'claimed by another process', true)
+        local seq
+        seq, err = b:publish('bar')
+        assert.is_nil(seq)
+        assert.match(err, 'claimed by another process', true)
+        return
+    end
+    local stat = assert(p:wait())
+    assert.is_table(stat)
+    assert.equal(b:publish('baz'), 2)
+    b:close()
+end
+
+function testcase.claim_takes_over_ring_of_exited_writer()
+    local b = broadcast.new()
+    local p = assert(fork())
+    if p:is_child() then
+        -- exit without releasing the ring
+        assert.is_true(b:claim())
+        assert.equal(b:publish('foo'), 1)
+        return
+    end
+    local stat = assert(p:wait())
+    assert.is_table(stat)
+    assert.is_true(b:claim())
+    assert.equal(b:publish('bar'), 2)
+    assert.equal(b:read(0), 'foo')
+    assert.equal(b:read(0), 'bar')
+    b:close()
+end
+
+function testcase.close_releases_ring()
+    local b = broadcast.new()
+    local p = assert(fork())
+    if p:is_child() then
+        assert.equal(b:read(2), 'closing')
+        -- the writer releases the ring after publishing the message
+        for _ = 1, 100 do
+            if b:claim() then
+                assert.equal(b:publish('foo'), 2)
+                return
+            end
+            sleep(0.01)
+        end
+        error('the ring has not been released')
+    end
+    assert.is_true(b:claim())
+    sleep(0.1)
+    assert.equal(b:publish('closing'), 1)
+    b:close()
+    local stat = assert(p:wait())
+    assert.is_table(stat)
+end
+
+function testcase.seek_skips_unread_entries()
+    local b = broadcast.new(4, 8)
+    assert.is_true(b:claim())
+    for i = 1, 10 do
+        b:publish(tostring(i))
+    end
+    assert.equal(b:seek(), 10)
+    assert.is_nil(b:read(0))
+    b:publish('11')
+    assert.equal(b:read(0), '11')
+    assert.equal(b:seek(), 0)
+    b:close()
+end
+
+function testcase.read_returns_timeout()
+    local b = broadcast.new()
+    -- poll
+    local msg, err, timeout = b:read(0)
+    assert.is_nil(msg)
+    assert.is_string(err)
+    assert.is_true(timeout)
+
+    msg, err, timeout = b:read(0.1)
+    assert.is_nil(msg)
+    assert.is_string(err)
+    assert.is_true(timeout)
+    b:close()
+end
+
+function testcase.read_returns_lagged()
+    local b = broadcast.new(4, 8)
+    assert.is_true(b:claim())
+    for i = 1, 10 do
+        b:publish(tostring(i))
+    end
+
+    -- entries 1 to 6 have been overwritten
+    local msg, err, timeout, skipped = b:read(0)
+    assert.is_nil(msg)
+    assert.is_nil(err)
+    assert.is_false(timeout)
+    assert.equal(skipped, 6)
+    for i = 7, 10 do
+        assert.equal(b:read(0), tostring(i))
+    end
+    assert.is_nil(b:read(0))
+    b:close()
+end
+
+function testcase.close_is_idempotent()
+    local b = broadcast.new()
+    b:close()
+    b:close()
+    local msg, err = b:read(0)
+    assert.is_nil(msg)
+    assert.is_string(err)
+    msg, err = b:publish('foo')
+    assert.is_nil(msg)
+    assert.is_string(err)
+end
+
+function testcase.readers_receive_entries_from_writer()
+    local b = broadcast.new()
+    local readers = {}
+    for i = 1, 3 do
+        local p = assert(fork())
+        if p:is_child() then
+            -- each reader has its own cursor
+            for j = 1, 3 do
+                assert.equal(b:read(2), 'msg' .. j)
+            end
+            return
+        end
+        readers[i] = p
+    end
+
+    sleep(0.2)
+    assert.is_true(b:claim())
+    for j = 1, 3 do
+        b:publish('msg' .. j)
+    end
+    for _, p in ipairs(readers) do
+        local stat = assert(p:wait())
+        assert.is_table(stat)
+    end
+    b:close()
+end
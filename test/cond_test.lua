@@ -122,3 +122,28 @@ function testcase.trylock_fails_when_held_by_another_process()
         c:destroy()
     end
 end
+
+function testcase.call_returns_results_of_function()
+    local c = cond.new()
+    local a, b = c:call(function(x)
+        -- wait releases and reacquires the lock
+        assert.is_false(c:timedwait(0.1))
+        return x, 'ok'
+    end, 'hello')
+    assert.equal(a, 'hello')
+    assert.equal(b, 'ok')
+    assert.is_true(c:trylock())
+    c:unlock()
+    c:destroy()
+end
+
+function testcase.call_unlocks_on_error()
+    local c = cond.new()
+    local err = assert.throws(c.call, c, function()
+        error('hello error')
+    end)
+    assert.match(err, 'hello error', true)
+    assert.is_true(c:trylock())
+    c:unlock()
+    c:destroy()
+end
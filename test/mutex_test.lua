@@ -67,3 +67,87 @@ function testcase.mutex_provides_exclusion_between_processes()
         m:destroy()
     end
 end
+
+function testcase.call_returns_results_of_function()
+    local m = mutex.new()
+    local a, b, c = m:call(function(x, y)
+        return x + y, nil, 'ok'
+    end, 1, 2)
+    assert.equal(a, 3)
+    assert.is_nil(b)
+    assert.equal(c, 'ok')
+    -- mutex is unlocked after the call
+    assert.is_true(m:trylock())
+    m:unlock()
+    m:destroy()
+end
+
+function testcase.call_unlocks_on_error()
+    local m = mutex.new()
+    local err = assert.throws(m.call, m, function()
+        error('hello error')
+    end)
+    assert.match(err, 'hello error', true)
+    assert.is_true(m:trylock())
+    m:unlock()
+    m:destroy()
+end
+
+function testcase.call_unlocks_when_function_yields()
+    local m = mutex.new()
+    local co = coroutine.create(function()
+        return m:call(function()
+            coroutine.yield()
+        end)
+    end)
+    -- fn cannot yield across the C-call boundary
+    local ok, err = coroutine.resume(co)
+    assert.is_false(ok)
+    assert.match(err, 'yield', true)
+    assert.is_true(m:trylock())
+    m:unlock()
+    m:destroy()
+end
+
+function testcase.call_keeps_lock_when_already_locked()
+    local m = mutex.new()
+    m:lock()
+    assert.equal(m:call(function()
+        return 'ok'
+    end), 'ok')
+    assert.is_true(m:unlock())
+    assert.is_true(m:trylock())
+    m:unlock()
+    m:destroy()
+end
+
+function testcase.call_throws_error_on_invalid_argument()
+    local m = mutex.new()
+    local err = assert.throws(m.call, m, 'foo')
+    assert.match(err, 'function expected', true)
+    err = assert.throws(m.call, {}, function()
+    end)
+    assert.match(err, 'sync.mutex expected', true)
+    m:destroy()
+end
+
+function testcase.call_provides_exclusion_between_processes()
+    local m = mutex.new()
+    local p = assert(fork())
+    if p:is_child() then
+        m:call(function()
+            sleep(1)
+        end)
+    else
+        -- wait for child to acquire the lock
+        sleep(0.2)
+        local ok = m:trylock()
+        -- mutex is held by child, trylock should fail
+        assert.is_false(ok)
+        m:call(function()
+            local stat = assert(p:wait())
+            assert.is_table(stat)
+        end)
+        m:destroy()
+    end
+end
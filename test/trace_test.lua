@@ -0,0 +1,191 @@
+require('luacov')
+local testcase = require('testcase')
+local fork = require('testcase.fork')
+local sleep = require('testcase.timer').sleep
+local assert = require('assert')
+local trace = require('sync.trace')
+local mutex = require('sync.mutex')
+local cond = require('sync.cond')
+
+function testcase.after_each()
+    trace.disable()
+end
+
+function testcase.enable_requires_positive_threshold()
+    local err = assert.throws(trace.enable, 0)
+    assert.match(err, 'sec must be greater than 0', false)
+    err = assert.throws(trace.enable, 0 / 0)
+    assert.match(err, 'sec must be greater than 0', false)
+end
+
+function testcase.enable_rejects_too_large_threshold()
+    for _, sec in ipairs({
+        86400.5,
+        1e20,
+        math.huge,
+    }) do
+        local err = assert.throws(trace.enable, sec)
+        assert.match(err, 'sec must be less than or equal to 86400', false)
+    end
+    trace.enable(86400)
+end
+
+function testcase.dump_returns_table()
+    assert.is_table(trace.dump())
+end
+
+function testcase.nothing_is_recorded_when_disabled()
+    local n = #trace.dump()
+    local m = mutex.new()
+    m:lock()
+    sleep(0.05)
+    m:unlock()
+    m:destroy()
+    assert.equal(#trace.dump(), n)
+end
+
+function testcase.nothing_is_recorded_below_threshold()
+    local n = #trace.dump()
+    local m = mutex.new()
+    trace.enable(10)
+    m:lock()
+    m:unlock()
+    m:destroy()
+    assert.equal(#trace.dump(), n)
+end
+
+function testcase.records_hold_time_of_mutex()
+    local m = mutex.new()
+    trace.enable(0.01)
+    m:lock()
+    sleep(0.05)
+    m:unlock()
+
+    local records = trace.dump()
+    local rec = records[#records]
+    assert.equal(rec.op, 'unlock')
+    assert.equal(rec.object, tostring(m))
+    assert.equal(rec.wait, 0)
+    assert.greater_or_equal(rec.hold, 0.01)
+    assert.match(rec.source, 'trace_test.lua', true)
+    assert.is_int(rec.line)
+    assert.is_int(rec.pid)
+    m:destroy()
+end
+
+function testcase.records_hold_time_of_cond()
+    local c = cond.new()
+    trace.enable(0.01)
+    assert(c:trylock())
+    sleep(0.05)
+    c:unlock()
+
+    local records = trace.dump()
+    local rec = records[#records]
+    assert.equal(rec.op, 'unlock')
+    assert.equal(rec.object, tostring(c))
+    assert.greater_or_equal(rec.hold, 0.01)
+    c:destroy()
+end
+
+function testcase.records_wait_time_and_holder_pid()
+    local m = mutex.new()
+    trace.enable(0.1)
+    local p = assert(fork())
+    if p:is_child() then
+        m:lock()
+        sleep(0.5)
+        m:unlock()
+    else
+        -- wait for child to acquire the lock
+        sleep(0.2)
+        m:lock()
+        m:unlock()
+        local stat = assert(p:wait())
+        assert.is_table(stat)
+
+        -- the records of the child are visible from the parent
+        local holder, waiter
+        for _, rec in ipairs(trace.dump()) do
+            if rec.object == tostring(m) then
+                if rec.op == 'unlock' then
+                    holder = rec
+                elseif rec.op == 'lock' then
+                    waiter = rec
+                end
+            end
+        end
+        assert.not_equal(holder.pid, waiter.pid)
+        assert.equal(holder.holder, holder.pid)
+        assert.equal(waiter.holder, holder.pid)
+        assert.greater_or_equal(holder.hold, 0.1)
+        assert.greater_or_equal(waiter.wait, 0.1)
+        assert.greater_or_equal(waiter.time, holder.time)
+        m:destroy()
+    end
+end
+
+function testcase.pid_is_refreshed_in_forked_process()
+    local m = mutex.new()
+    trace.enable(0.01)
+    m:lock()
+    sleep(0.02)
+    m:unlock()
+    local p = assert(fork())
+    if p:is_child() then
+        m:lock()
+        sleep(0.02)
+        m:unlock()
+        return
+    end
+    assert(p:wait())
+
+    local pids = {}
+    for _, rec in ipairs(trace.dump()) do
+        if rec.object == tostring(m) then
+            pids[#pids + 1] = rec.pid
+            assert.equal(rec.holder, rec.pid)
+        end
+    end
+    assert.equal(#pids, 2)
+    assert.not_equal(pids[1], pids[2])
+    m:destroy()
+end
+
+function testcase.records_stall_while_waiting()
+    local m = mutex.new()
+    trace.enable(0.1)
+    local p = assert(fork())
+    if p:is_child() then
+        -- wait for parent to acquire the lock
+        sleep(0.2)
+        m:lock()
+        m:unlock()
+        return
+    end
+
+    m:lock()
+    sleep(0.6)
+    -- the child is still waiting for the lock
+    local stall
+    for _, rec in ipairs(trace.dump()) do
+        if rec.object == tostring(m) and rec.op == 'stall' then
+            stall = rec
+        end
+    end
+    assert.is_table(stall)
+    assert.greater_or_equal(stall.wait, 0.1)
+    assert.equal(stall.hold, 0)
+    m:unlock()
+    assert(p:wait())
+
+    local holder
+    for _, rec in ipairs(trace.dump()) do
+        if rec.object == tostring(m) and rec.op == 'unlock' then
+            holder = rec
+        end
+    end
+    assert.equal(stall.holder, holder.pid)
+    assert.not_equal(stall.pid, holder.pid)
+    m:destroy()
+end